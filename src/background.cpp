@@ -0,0 +1,127 @@
+// Copyright (C) 2005 - 2026 Settlers Freaks <sf-team at siedler25.org>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include "background.h"
+#include "s25util/file_handle.h"
+#include <boost/nowide/cstdio.hpp>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#ifdef _WIN32
+#    include <windows.h>
+#else
+#    include <fcntl.h>
+#    include <sys/resource.h>
+#    include <unistd.h>
+#    ifdef __linux__
+#        include <sys/syscall.h>
+#    endif
+#endif
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+std::mutex ioRateMutex;
+uint64_t ioRateLimit = 0;
+/// Time at which all I/O accounted so far is allowed by the rate limit
+Clock::time_point ioNextAllowed;
+
+std::atomic<bool> dropPageCache(false);
+
+#ifdef __linux__
+// From linux/ioprio.h which is not always available
+constexpr int IOPRIO_CLASS_SHIFT = 13;
+constexpr int IOPRIO_CLASS_IDLE = 3;
+constexpr int IOPRIO_WHO_PROCESS = 1;
+#endif
+} // namespace
+
+bool lowerProcessPriority()
+{
+#ifdef _WIN32
+    // Lowers the CPU, I/O and memory priority
+    return SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN) != 0;
+#else
+    // On Linux those only affect the calling thread, but are inherited by new threads
+    bool result = setpriority(PRIO_PROCESS, 0, 19) == 0;
+#    if defined(__linux__) && defined(SYS_ioprio_set)
+    // Only do I/O when no one else does
+    if(syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+        result = false;
+#    elif defined(__APPLE__)
+    if(setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_THROTTLE) != 0)
+        result = false;
+#    endif
+    return result;
+#endif
+}
+
+void setIoRateLimit(uint64_t bytesPerSecond)
+{
+    std::lock_guard<std::mutex> lock(ioRateMutex);
+    ioRateLimit = bytesPerSecond;
+    ioNextAllowed = Clock::now();
+}
+
+void throttleIo(size_t numBytes)
+{
+    Clock::duration wait;
+    {
+        std::lock_guard<std::mutex> lock(ioRateMutex);
+        if(ioRateLimit == 0)
+            return;
+        const auto now = Clock::now();
+        // Don't allow bursts after idle times
+        if(ioNextAllowed < now)
+            ioNextAllowed = now;
+        ioNextAllowed += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(
+          static_cast<double>(numBytes) / static_cast<double>(ioRateLimit)));
+        wait = ioNextAllowed - now;
+    }
+    std::this_thread::sleep_for(wait);
+}
+
+bool isIoRestricted()
+{
+    if(dropPageCache)
+        return true;
+    std::lock_guard<std::mutex> lock(ioRateMutex);
+    return ioRateLimit != 0;
+}
+
+void setDropFromPageCache(bool enabled)
+{
+    dropPageCache = enabled;
+}
+
+void avoidPageCache(FILE* fp)
+{
+    if(!dropPageCache || !fp)
+        return;
+#ifdef F_NOCACHE
+    // macOS has no posix_fadvise, but can bypass the cache for this file descriptor
+    fcntl(fileno(fp), F_NOCACHE, 1);
+#endif
+}
+
+void dropFromPageCache(FILE* fp)
+{
+    if(!dropPageCache || !fp)
+        return;
+#ifdef POSIX_FADV_DONTNEED
+    // Only clean pages can be dropped, so write back the data of just written files first
+    fflush(fp);
+    fdatasync(fileno(fp));
+    posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+void dropFromPageCache(const std::string& filepath)
+{
+    if(!dropPageCache)
+        return;
+    s25util::file_handle fh(boost::nowide::fopen(filepath.c_str(), "rb"));
+    dropFromPageCache(*fh);
+}
@@ -0,0 +1,28 @@
+// Copyright (C) 2005 - 2026 Settlers Freaks <sf-team at siedler25.org>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+/// Lower the CPU and disk I/O priority of the process. Must be called before starting any threads.
+/// Returns false if any of those failed
+bool lowerProcessPriority();
+
+/// Limit the rate of disk I/O done for hashing and extracting files in bytes/s (0 = unlimited)
+void setIoRateLimit(uint64_t bytesPerSecond);
+/// Account for I/O of the given size and wait if that exceeds the rate limit
+void throttleIo(size_t numBytes);
+/// True if file I/O should be done via throttleIo and the page cache hints instead of faster OS functions
+bool isIoRestricted();
+
+/// Enable dropping hashed and written files from the page cache to not evict the data of other processes
+void setDropFromPageCache(bool enabled);
+/// Hint the OS to not cache following I/O of the just opened file, if enabled. Only supported on macOS
+void avoidPageCache(FILE* fp);
+/// Hint the OS that the (fully read or written) file won't be used again, if enabled
+void dropFromPageCache(FILE* fp);
+void dropFromPageCache(const std::string& filepath);
@@ -0,0 +1,72 @@
+// Copyright (C) 2005 - 2026 Settlers Freaks <sf-team at siedler25.org>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include "filehash.h"
+#include "background.h"
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+
+std::optional<HashAlgorithm> parseHashAlgorithm(const std::string& name)
+{
+    if(name == "md5")
+        return HashAlgorithm::Md5;
+    if(name == "xxh64")
+        return HashAlgorithm::Xxh64;
+    return std::nullopt;
+}
+
+namespace {
+std::variant<s25util::md5, Xxh64> createState(HashAlgorithm algorithm)
+{
+    switch(algorithm)
+    {
+        case HashAlgorithm::Md5: return s25util::md5("");
+        case HashAlgorithm::Xxh64: return Xxh64();
+    }
+    throw std::invalid_argument("Invalid hash algorithm");
+}
+
+struct ProcessVisitor
+{
+    const void* data;
+    size_t len;
+    void operator()(s25util::md5& md5) const { md5.process(data, len, true); }
+    void operator()(Xxh64& xxh) const { xxh.process(data, len); }
+};
+} // namespace
+
+FileHasher::FileHasher(HashAlgorithm algorithm) : state_(createState(algorithm)) {}
+
+void FileHasher::process(const void* data, size_t len)
+{
+    std::visit(ProcessVisitor{data, len}, state_);
+}
+
+std::string FileHasher::toString()
+{
+    return std::visit([](auto& state) { return state.toString(); }, state_);
+}
+
+int hashfile(FILE* fp, HashAlgorithm algorithm, std::string& digest)
+{
+    if(!fp)
+        return -1;
+    // Large buffer to reduce the number of reads, the hashing itself is cheap
+    std::array<uint8_t, 64 * 1024> buf;
+    FileHasher hasher(algorithm);
+
+    size_t n;
+    while((n = fread(buf.data(), 1, buf.size(), fp)) > 0)
+    {
+        throttleIo(n);
+        hasher.process(buf.data(), n);
+    }
+
+    digest = hasher.toString();
+
+    if(ferror(fp))
+        return -1;
+    return 0;
+}
@@ -0,0 +1,39 @@
+// Copyright (C) 2005 - 2026 Settlers Freaks <sf-team at siedler25.org>
+// Copyright (c) 2005 - 2015 FloSoft (webmaster at flo-soft.de)
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include "xxhash64.h"
+#include "s25util/md5.hpp"
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <variant>
+
+/// Hash algorithms which may be used in the filelist
+enum class HashAlgorithm
+{
+    Md5,
+    Xxh64
+};
+
+/// Get the algorithm from its name in the filelist ("md5", "xxh64")
+std::optional<HashAlgorithm> parseHashAlgorithm(const std::string& name);
+
+/// Incrementally hashes data with the given algorithm
+class FileHasher
+{
+public:
+    explicit FileHasher(HashAlgorithm algorithm);
+
+    void process(const void* data, size_t len);
+    /// Return the lowercase hex digest of all data processed so far
+    std::string toString();
+
+private:
+    std::variant<s25util::md5, Xxh64> state_;
+};
+
+int hashfile(FILE* fp, HashAlgorithm algorithm, std::string& digest);
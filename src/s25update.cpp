@@ -3,7 +3,8 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
 #include "s25update.h" // IWYU pragma: keep
-#include "md5sum.h"
+#include "background.h"
+#include "filehash.h"
 #include "s25util/file_handle.h"
 #include "s25util/warningSuppression.h"
 #include <boost/filesystem.hpp>
@@ -12,11 +13,21 @@
 #include <boost/nowide/iostream.hpp>
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <bzlib.h>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
 #include <curl/curl.h>
 #include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <random>
+#include <set>
 #include <sstream>
+#include <thread>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -62,6 +73,7 @@ namespace bnw = boost::nowide;
 #define FILELIST "/files"
 #define LINKLIST "/links"
 #define SAVEGAMEVERSION "/savegameversion"
+#define MANIFESTV2HEADER "s25update-manifest 2"
 
 #ifndef SEE_MASK_NOASYNC
 #    define SEE_MASK_NOASYNC 0x00000100
@@ -69,6 +81,9 @@ namespace bnw = boost::nowide;
 
 namespace {
 
+/// Used by worker threads to not mix up their output
+std::mutex consoleMutex;
+
 class EasyCurl
 {
     CURL* h_;
@@ -78,7 +93,8 @@ public:
     EasyCurl(EasyCurl&& rhs) noexcept : h_(std::exchange(rhs.h_, nullptr)) {}
     EasyCurl& operator=(EasyCurl&& rhs) noexcept
     {
-        h_ = std::exchange(rhs.h_, nullptr);
+        // rhs cleans up our old handle
+        std::swap(h_, rhs.h_);
         return *this;
     }
     ~EasyCurl() { curl_easy_cleanup(h_); }
@@ -91,6 +107,15 @@ public:
 
     CURLcode perform() { return curl_easy_perform(h_); }
 
+    CURL* get() const { return h_; }
+
+    long getResponseCode() const
+    {
+        long code = 0;
+        curl_easy_getinfo(h_, CURLINFO_RESPONSE_CODE, &code);
+        return code;
+    }
+
     std::optional<std::string> escape(const std::string& s) const
     {
         char* out = curl_easy_escape(h_, s.c_str(), static_cast<int>(s.length()));
@@ -190,17 +215,76 @@ std::string EscapeFile(const bfs::path& file)
         throw std::invalid_argument("Failed to escape '" + file.string() + '"');
 }
 
-/**
- *  httpdownload function (to std::string or to file, with or without progressbar)
- */
-bool DoDownloadFile(const std::string& url, const std::variant<std::string*, FILE*>& target,
-                    std::string* progress = nullptr)
+struct DownloadOptions
 {
-    EasyCurl curl;
+    /// Number of retries for each request after a transient error
+    int retries = 4;
+    /// Timeout for establishing a connection in seconds
+    long connectTimeout = 30;
+    /// Abort transfers slower than lowSpeedLimit bytes/s for lowSpeedTime seconds
+    long lowSpeedLimit = 1000;
+    long lowSpeedTime = 30;
+    /// Maximum download rate in bytes/s (0 = unlimited)
+    curl_off_t maxDownloadRate = 0;
+    /// Compressed files of at least this size are downloaded as multiple parallel byte ranges.
+    /// Only files whose uncompressed size in the filelist reaches it are probed for their compressed size
+    uintmax_t segmentedDownloadThreshold = 8 * 1024 * 1024;
+    /// Maximum number of parallel ranges of a file (1 = disabled)
+    int numSegments = 4;
+};
+DownloadOptions downloadOptions;
+
+enum class DownloadResult
+{
+    Ok,
+    Failed,
+    /// Retrying the request won't help, e.g. file not found
+    FailedPermanently
+};
 
+/// Set the options shared by all downloads
+void setCommonOptions(EasyCurl& curl, const std::string& url, const curl_off_t maxDownloadRate)
+{
     curl.setOpt(CURLOPT_URL, url.c_str());
     curl.setOpt(CURLOPT_USERAGENT, "s25update/1.1");
     curl.setOpt(CURLOPT_FAILONERROR, 1L);
+    curl.setOpt(CURLOPT_CONNECTTIMEOUT, downloadOptions.connectTimeout);
+    curl.setOpt(CURLOPT_LOW_SPEED_LIMIT, downloadOptions.lowSpeedLimit);
+    curl.setOpt(CURLOPT_LOW_SPEED_TIME, downloadOptions.lowSpeedTime);
+    if(maxDownloadRate > 0)
+        curl.setOpt(CURLOPT_MAX_RECV_SPEED_LARGE, maxDownloadRate);
+}
+
+DownloadResult getDownloadResult(const EasyCurl& curl, const CURLcode res)
+{
+    if(res == CURLE_OK)
+        return DownloadResult::Ok;
+    bnw::cerr << "Download error: " << curl_easy_strerror(res) << '\n';
+    switch(res)
+    {
+        case CURLE_HTTP_RETURNED_ERROR:
+        {
+            // Only server errors and rate limiting may go away
+            const long responseCode = curl.getResponseCode();
+            return (responseCode >= 500 || responseCode == 408 || responseCode == 429) ?
+                     DownloadResult::Failed :
+                     DownloadResult::FailedPermanently;
+        }
+        case CURLE_URL_MALFORMAT:
+        case CURLE_UNSUPPORTED_PROTOCOL:
+        case CURLE_WRITE_ERROR: return DownloadResult::FailedPermanently;
+        default: return DownloadResult::Failed;
+    }
+}
+
+/**
+ *  httpdownload function (to std::string or to file, with or without progressbar)
+ */
+DownloadResult DoDownloadFile(const std::string& url, const std::variant<std::string*, FILE*>& target,
+                              std::string* progress = nullptr)
+{
+    EasyCurl curl;
+    setCommonOptions(curl, url, downloadOptions.maxDownloadRate);
 
     // Show Progress?
     if(progress)
@@ -228,43 +312,284 @@ bool DoDownloadFile(const std::string& url, const std::variant<std::string*, FIL
         curl.setOpt(CURLOPT_WRITEDATA, static_cast<void*>(memory));
     }
 
-    const auto res = curl.perform();
-    if(res == CURLE_OK)
+    return getDownloadResult(curl, curl.perform());
+}
+
+/// Delay before the given retry: Exponential backoff with jitter to avoid synchronized retries of many clients
+std::chrono::milliseconds getRetryDelay(int retry)
+{
+    static std::mt19937 rng{std::random_device{}()};
+    const int maxDelay = std::min(500 << std::min(retry, 6), 30000);
+    return std::chrono::milliseconds(std::uniform_int_distribution<int>(maxDelay / 2, maxDelay)(rng));
+}
+
+/// Call the download function until it succeeded, failed permanently or the number of retries is exhausted
+template<typename T_Download>
+bool DoDownloadWithRetries(const std::string& url, T_Download&& download)
+{
+    for(int retry = 0;; ++retry)
+    {
+        const DownloadResult result = download();
+        if(result == DownloadResult::Ok)
+            return true;
+        if(result == DownloadResult::FailedPermanently || retry >= downloadOptions.retries)
+            return false;
+        const auto delay = getRetryDelay(retry);
+        bnw::cerr << "Retrying download of " << url << " in " << delay.count() << "ms" << std::endl;
+        std::this_thread::sleep_for(delay);
+    }
+}
+
+/// Seek to an absolute offset which may exceed the range of long (32 bit on Windows)
+bool seekTo(FILE* fp, curl_off_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(fp, offset, SEEK_SET) == 0;
+#else
+    return fseeko(fp, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+/// Byte range of a file downloaded in parallel to other ranges
+struct Segment
+{
+    s25util::file_handle fh;
+    /// Next byte to download and last byte of the range
+    curl_off_t offset, end;
+    curl_off_t start;
+    int retries = 0;
+    EasyCurl curl;
+    /// Whether the handle was added to the multi handle
+    bool active = false;
+    /// Time after which a failed segment is resumed
+    std::chrono::steady_clock::time_point resumeAt;
+
+    Segment(FILE* fp, curl_off_t start, curl_off_t end) : fh(fp), offset(start), end(end), start(start) {}
+    bool isFinished() const { return offset > end; }
+};
+
+/**
+ *  curl segment writer callback
+ */
+size_t SegmentWriteCallback(void* ptr, size_t size, size_t nmemb, Segment* segment)
+{
+    size_t realsize = size * nmemb;
+
+    // More data than requested: The server ignores the range
+    if(static_cast<curl_off_t>(realsize) > segment->end + 1 - segment->offset)
+        return 0;
+    if(realsize != fwrite(ptr, size, nmemb, *segment->fh))
+        return 0;
+    segment->offset += realsize;
+    return realsize;
+}
+
+/**
+ *  Download a large file as multiple byte ranges in parallel, as a single connection may be limited by the latency.
+ *  Failed ranges are resumed. Returns nothing if the server does not support ranges or the file is too small.
+ */
+std::optional<DownloadResult> DoSegmentedDownload(const std::string& url, const bfs::path& path,
+                                                  std::string* progress)
+{
+#if CURL_AT_LEAST_VERSION(7, 55, 0)
+    // Minimum size of a segment to make the overhead of another connection worth it
+    constexpr curl_off_t minSegmentSize = 1024 * 1024;
+
+    std::string headers;
+    curl_off_t length;
+    {
+        EasyCurl curl;
+        setCommonOptions(curl, url, 0);
+        curl.setOpt(CURLOPT_NOBODY, 1L);
+        curl.setOpt(CURLOPT_HEADERFUNCTION, WriteMemoryCallback);
+        curl.setOpt(CURLOPT_HEADERDATA, static_cast<void*>(&headers));
+        if(curl.perform() != CURLE_OK || curl_easy_getinfo(curl.get(), CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length)
+                                           != CURLE_OK)
+            return std::nullopt;
+    }
+    std::transform(headers.begin(), headers.end(), headers.begin(),
+                   [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+    const curl_off_t numSegments = std::min<curl_off_t>(downloadOptions.numSegments, length / minSegmentSize);
+    if(headers.find("accept-ranges: bytes") == std::string::npos || numSegments < 2
+       || static_cast<uintmax_t>(length) < downloadOptions.segmentedDownloadThreshold)
+        return std::nullopt;
+
+    // Preallocate the file so all segments can be written to it directly
+    {
+        s25util::file_handle target_fh(boost::nowide::fopen(path.string().c_str(), "wb"));
+        boost::system::error_code ec;
+        if(target_fh)
+            bfs::resize_file(path, static_cast<uintmax_t>(length), ec);
+        if(!target_fh || ec)
+        {
+            bnw::cerr << "Can't open file " << path << "!" << std::endl;
+            return DownloadResult::FailedPermanently;
+        }
+    }
+    // Declared first so the easy handles of the segments get removed from it before it is destroyed
+    std::unique_ptr<CURLM, decltype(&curl_multi_cleanup)> multi(curl_multi_init(), curl_multi_cleanup);
+    std::vector<std::unique_ptr<Segment>> segments;
+    for(curl_off_t i = 0; i < numSegments; i++)
+    {
+        const curl_off_t start = length * i / numSegments;
+        const curl_off_t end = length * (i + 1) / numSegments - 1;
+        segments.push_back(
+          std::make_unique<Segment>(boost::nowide::fopen(path.string().c_str(), "r+b"), start, end));
+        if(!segments.back()->fh)
+            return DownloadResult::FailedPermanently;
+    }
+
+    const auto startSegment = [&](Segment& segment) {
+        if(!seekTo(*segment.fh, segment.offset))
+            return false;
+        segment.curl = EasyCurl();
+        setCommonOptions(segment.curl, url, downloadOptions.maxDownloadRate / numSegments);
+        const std::string range = std::to_string(segment.offset) + "-" + std::to_string(segment.end);
+        segment.curl.setOpt(CURLOPT_RANGE, range.c_str());
+        segment.curl.setOpt(CURLOPT_WRITEFUNCTION, SegmentWriteCallback);
+        segment.curl.setOpt(CURLOPT_WRITEDATA, static_cast<void*>(&segment));
+        curl_multi_add_handle(multi.get(), segment.curl.get());
+        segment.active = true;
         return true;
-    bnw::cerr << "Download error: " << curl_easy_strerror(res) << '\n';
-    return false;
+    };
+    for(auto& segment : segments)
+    {
+        if(!startSegment(*segment))
+            return DownloadResult::FailedPermanently;
+    }
+
+    while(true)
+    {
+        int running;
+        if(curl_multi_perform(multi.get(), &running) != CURLM_OK)
+            return DownloadResult::Failed;
+        if(progress)
+        {
+            curl_off_t downloaded = 0;
+            for(const auto& segment : segments)
+                downloaded += segment->offset - segment->start;
+            ProgressBarCallback(progress, length, downloaded, 0, 0);
+        }
+
+        CURLMsg* msg;
+        int msgsLeft;
+        while((msg = curl_multi_info_read(multi.get(), &msgsLeft)))
+        {
+            if(msg->msg != CURLMSG_DONE)
+                continue;
+            const auto itSegment = std::find_if(segments.begin(), segments.end(), [msg](const auto& segment) {
+                return segment->curl.get() == msg->easy_handle;
+            });
+            Segment& segment = **itSegment;
+            const CURLcode res = msg->data.result;
+            curl_multi_remove_handle(multi.get(), msg->easy_handle);
+            segment.active = false;
+            // A full response instead of the range. Will get CURLE_WRITE_ERROR before finishing the download
+            if(segment.curl.getResponseCode() == 200)
+                return std::nullopt;
+            DownloadResult result = getDownloadResult(segment.curl, res);
+            if(result == DownloadResult::FailedPermanently)
+                return result;
+            // Less data than requested: Resume it
+            if(result == DownloadResult::Ok && !segment.isFinished())
+                result = DownloadResult::Failed;
+            if(result == DownloadResult::Failed)
+            {
+                if(++segment.retries > downloadOptions.retries)
+                    return result;
+                const auto delay = getRetryDelay(segment.retries - 1);
+                bnw::cerr << "Retrying range " << segment.offset << "-" << segment.end << " of " << url << " in "
+                          << delay.count() << "ms" << std::endl;
+                segment.resumeAt = std::chrono::steady_clock::now() + delay;
+            }
+        }
+
+        // Resume failed segments while the others keep running
+        const auto now = std::chrono::steady_clock::now();
+        bool anyActive = false;
+        std::optional<std::chrono::steady_clock::time_point> nextResume;
+        for(auto& segment : segments)
+        {
+            if(!segment->active && !segment->isFinished())
+            {
+                if(segment->resumeAt > now)
+                {
+                    nextResume = nextResume ? std::min(*nextResume, segment->resumeAt) : segment->resumeAt;
+                    continue;
+                }
+                if(!startSegment(*segment))
+                    return DownloadResult::FailedPermanently;
+            }
+            anyActive |= segment->active;
+        }
+        if(anyActive)
+            curl_multi_wait(multi.get(), nullptr, 0, 100, nullptr);
+        else if(nextResume)
+            std::this_thread::sleep_until(*nextResume);
+        else
+            break;
+    }
+    if(std::any_of(segments.begin(), segments.end(), [](const auto& segment) { return !segment->isFinished(); }))
+        return DownloadResult::Failed;
+    return DownloadResult::Ok;
+#else
+    RTTR_UNUSED(url);
+    RTTR_UNUSED(path);
+    RTTR_UNUSED(progress);
+    return std::nullopt;
+#endif
 }
 
-bool DownloadFile(const std::string& url, const bfs::path& path, std::string progress = "")
+/**
+ *  Download the file. If the expected (uncompressed) size is known and large enough,
+ *  byte ranges are downloaded in parallel if the file on the server is large enough too
+ */
+bool DownloadFile(const std::string& url, const bfs::path& path, std::string progress = "",
+                  std::optional<uintmax_t> expectedSize = std::nullopt)
 {
-    s25util::file_handle target_fh(boost::nowide::fopen(path.string().c_str(), "wb"));
-    if(!target_fh)
+    if(downloadOptions.numSegments > 1 && expectedSize && *expectedSize >= downloadOptions.segmentedDownloadThreshold)
     {
-        bnw::cerr << "Can't open file " << path << "!" << std::endl;
-        return false;
+        const auto result = DoSegmentedDownload(url, path, &progress);
+        if(result)
+            return result == DownloadResult::Ok;
     }
-    return DoDownloadFile(url, *target_fh, &progress);
+    return DoDownloadWithRetries(url, [&]() {
+        s25util::file_handle target_fh(boost::nowide::fopen(path.string().c_str(), "wb"));
+        if(!target_fh)
+        {
+            bnw::cerr << "Can't open file " << path << "!" << std::endl;
+            return DownloadResult::FailedPermanently;
+        }
+        return DoDownloadFile(url, *target_fh, &progress);
+    });
 }
 
 std::optional<std::string> DownloadFile(const std::string& url)
 {
     std::string tmp;
-    if(DoDownloadFile(url, &tmp))
+    if(DoDownloadWithRetries(url, [&]() {
+           tmp.clear();
+           return DoDownloadFile(url, &tmp);
+       }))
         return tmp;
     else
         return std::nullopt;
 }
 
 /**
- *  calculate md5sum for a file
+ *  calculate the hash of a file
  */
-std::string md5sum(const std::string& file)
+std::string hashsum(const std::string& file, HashAlgorithm algorithm)
 {
     std::string digest;
 
     s25util::file_handle fh(boost::nowide::fopen(file.c_str(), "rb"));
     if(fh)
-        md5file(*fh, digest);
+    {
+        avoidPageCache(*fh);
+        hashfile(*fh, algorithm, digest);
+        dropFromPageCache(*fh);
+    }
 
     return digest;
 }
@@ -288,10 +613,9 @@ std::string get_last_error_string()
 #endif
 
 // Checks the savegame version and return true if update can continue
-bool ValidateSavegameVersion(const std::string& httpbase, const bfs::path& savegameversionFilePath)
+bool ValidateSavegameVersion(const std::optional<std::string>& remote_savegameversion_content,
+                             const bfs::path& savegameversionFilePath)
 {
-    // check new savegame version before downloading
-    const auto remote_savegameversion_content = DownloadFile(httpbase + SAVEGAMEVERSION);
     if(!remote_savegameversion_content)
     {
         bnw::cerr << "Error: Was not able to get remote savegame version, ignoring for now" << std::endl;
@@ -335,10 +659,11 @@ bool ValidateSavegameVersion(const std::string& httpbase, const bfs::path& saveg
     }
 }
 
-bool isCurrentDirWritable()
+bool isDirWritable(const bfs::path& dir)
 {
+    const bfs::path testFilePath = dir / "write.test";
 #ifdef _WIN32
-    HANDLE hFile = CreateFileW(L"write.test", GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    HANDLE hFile = CreateFileW(testFilePath.wstring().c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
     if(hFile == INVALID_HANDLE_VALUE)
     {
         if(GetLastError() != ERROR_ACCESS_DENIED)
@@ -347,15 +672,15 @@ bool isCurrentDirWritable()
     } else
     {
         CloseHandle(hFile);
-        DeleteFileW(L"write.test");
+        DeleteFileW(testFilePath.wstring().c_str());
         return true;
     }
 #else
-    bnw::ofstream testFile("write.test", bnw::ofstream::trunc);
+    bnw::ofstream testFile(testFilePath, bnw::ofstream::trunc);
     if(testFile)
     {
         testFile.close();
-        bfs::remove("write.test");
+        bfs::remove(testFilePath);
         return true;
     } else
         return false;
@@ -390,23 +715,75 @@ bool runAsAdmin(int argc, char* argv[])
     return false;
 }
 
+struct FileEntry
+{
+    std::string path;
+    HashAlgorithm hashAlgorithm = HashAlgorithm::Md5;
+    std::string hash;
+    /// Size and permissions of the uncompressed file, only known for v2 filelists
+    std::optional<uintmax_t> size;
+    std::optional<unsigned> mode;
+};
+
+/// Parse a line of the v1 filelist format: <md5>  <path>
+FileEntry parseFileListV1Line(const std::string& line)
+{
+    if(line.size() < 34 || line.substr(32, 2) != "  ")
+        throw std::runtime_error("Invalid line in filelist: " + line);
+    FileEntry entry;
+    entry.hash = line.substr(0, 32);
+    entry.path = line.substr(34);
+    return entry;
+}
+
+/// Parse a line of the v2 filelist format: <algorithm>:<hash> <size> <octal mode> <path>
+FileEntry parseFileListV2Line(const std::string& line)
+{
+    std::stringstream lineStream(line);
+    std::string hash;
+    uintmax_t size;
+    unsigned mode;
+    if(!(lineStream >> hash >> size >> std::oct >> mode) || lineStream.get() != ' ')
+        throw std::runtime_error("Invalid line in filelist: " + line);
+
+    FileEntry entry;
+    const auto colonPos = hash.find(':');
+    const auto algorithm = parseHashAlgorithm(hash.substr(0, colonPos));
+    if(colonPos == std::string::npos || !algorithm)
+        throw std::runtime_error("Invalid hash in filelist: " + hash);
+    entry.hashAlgorithm = *algorithm;
+    entry.hash = hash.substr(colonPos + 1);
+    std::transform(entry.hash.begin(), entry.hash.end(), entry.hash.begin(),
+                   [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+    entry.size = size;
+    entry.mode = mode;
+    getline(lineStream, entry.path);
+    if(entry.path.empty())
+        throw std::runtime_error("Invalid line in filelist: " + line);
+    return entry;
+}
+
 auto parseFileList(const std::string& filelistFileContents)
 {
-    std::vector<std::pair<std::string, std::string>> files;
+    std::vector<FileEntry> files;
     std::stringstream flstream(filelistFileContents);
 
     std::string line;
+    bool isV2 = false;
+    if(getline(flstream, line) && line == MANIFESTV2HEADER)
+        isV2 = true;
+    else
+        flstream.seekg(0);
+
     while(getline(flstream, line))
     {
         if(line.empty())
             break;
 
-        if(line.substr(32, 2) != "  ")
-            throw std::runtime_error("Invalid line in filelist: " + line);
-        std::string hash = line.substr(0, 32);
-        std::string file = line.substr(34);
-
-        files.emplace_back(std::move(hash), std::move(file));
+        if(!isV2)
+            files.push_back(parseFileListV1Line(line));
+        else if(line[0] != '#')
+            files.push_back(parseFileListV2Line(line));
 
         if(flstream.fail())
             break;
@@ -414,6 +791,45 @@ auto parseFileList(const std::string& filelistFileContents)
     return files;
 }
 
+/// Get the hash of the file on disk. Nothing if it does not exist or the (cheap) size check already shows it differs
+std::optional<std::string> hashLocalFile(const bfs::path& filepath, const FileEntry& file)
+{
+    boost::system::error_code ec;
+    const auto size = bfs::file_size(filepath, ec);
+    if(ec || (file.size && size != *file.size))
+        return std::nullopt;
+    return hashsum(filepath.string(), file.hashAlgorithm);
+}
+
+/// Identifies the content of a file: hash algorithm and hash
+using ContentKey = std::pair<HashAlgorithm, std::string>;
+
+ContentKey getContentKey(const FileEntry& file)
+{
+    return ContentKey(file.hashAlgorithm, file.hash);
+}
+
+/// Set the permissions of the file to the ones from the filelist (if any)
+void applyFileMode(const bfs::path& filepath, const std::optional<unsigned>& mode)
+{
+#ifdef _WIN32
+    RTTR_UNUSED(filepath);
+    RTTR_UNUSED(mode);
+#else
+    if(!mode)
+        return;
+    // Don't allow setuid, setgid or sticky bits as the updater may run with elevated rights
+    const auto perms = static_cast<bfs::perms>(*mode & 0777);
+    boost::system::error_code ec;
+    if(bfs::status(filepath, ec).permissions() == perms)
+        return;
+    bfs::permissions(filepath, perms, ec);
+    std::lock_guard<std::mutex> lock(consoleMutex);
+    if(ec)
+        bnw::cerr << "Failed to set permissions of " << filepath << ": " << ec.message() << std::endl;
+#endif
+}
+
 auto parseLinkList(const std::string& linkFileContents)
 {
     // Format: <symlinkFilePath> <linkTarget>
@@ -445,7 +861,29 @@ struct BzFileCloser
     }
 };
 
-void extractFile(const bfs::path& bzFile, const bfs::path& targetFilepath)
+/// Move the temporary file to the target path replacing the existing file
+void replaceFile(const bfs::path& tmpFilepath, const bfs::path& targetFilepath)
+{
+    boost::system::error_code error;
+    bfs::rename(tmpFilepath, targetFilepath, error);
+    if(!error)
+        return;
+    // move blocked file (e.g. running executable) out of the way ...
+    bfs::path bakFilePath(targetFilepath);
+    bakFilePath += ".bak";
+    bfs::rename(targetFilepath, bakFilePath, error);
+    if(error)
+        throw std::runtime_error("failed to move blocked file " + targetFilepath.string() + " out of the way ...");
+    bfs::rename(tmpFilepath, targetFilepath, error);
+    if(error)
+        throw std::runtime_error("Failed to replace " + targetFilepath.string() + ": " + error.message());
+}
+
+/**
+ *  Extract the file to the target path. The content is hashed while it is written and the target is only replaced
+ *  if it matches the filelist entry. Returns false if the download is corrupt
+ */
+bool extractFile(const bfs::path& bzFile, const FileEntry& file, const bfs::path& targetFilepath)
 {
     s25util::file_handle bz_fh(boost::nowide::fopen(bzFile.string().c_str(), "rb"));
     if(!bz_fh)
@@ -454,35 +892,120 @@ void extractFile(const bfs::path& bzFile, const bfs::path& targetFilepath)
     int bzerror = BZ_OK;
     std::unique_ptr<BZFILE, BzFileCloser> bz2fp(BZ2_bzReadOpen(&bzerror, *bz_fh, 0, 0, nullptr, 0));
     if(!bz2fp)
-        throw std::runtime_error("decompression failed: compressed file corrupt?");
+        return false;
 
-    bnw::ofstream outputFile(targetFilepath, bnw::ofstream::binary | bnw::ofstream::trunc);
-    if(!outputFile)
-    {
-        bfs::path bakFilePath(targetFilepath);
-        bakFilePath += ".bak";
-        boost::system::error_code error;
-        bfs::rename(targetFilepath, bakFilePath, error);
-        // move file out of the way ...
-        if(error)
-            throw std::runtime_error("failed to move blocked file " + targetFilepath.string() + " out of the way ...");
-        outputFile.open(targetFilepath, bnw::ofstream::binary | bnw::ofstream::trunc);
-    }
+    bfs::path tmpFilepath(targetFilepath);
+    tmpFilepath += ".new";
+    bnw::ofstream outputFile(tmpFilepath, bnw::ofstream::binary | bnw::ofstream::trunc);
     if(!outputFile)
-        throw std::runtime_error("Failed to open output file " + targetFilepath.string());
+        throw std::runtime_error("Failed to open output file " + tmpFilepath.string());
 
+    FileHasher hasher(file.hashAlgorithm);
+    uintmax_t size = 0;
     while(bzerror == BZ_OK)
     {
-        std::array<char, 1024> buffer;
-        unsigned read = BZ2_bzRead(&bzerror, bz2fp.get(), buffer.data(), static_cast<int>(buffer.size()));
+        std::array<char, 64 * 1024> buffer;
+        const int read = BZ2_bzRead(&bzerror, bz2fp.get(), buffer.data(), static_cast<int>(buffer.size()));
+        if(bzerror != BZ_OK && bzerror != BZ_STREAM_END)
+            break;
+        throttleIo(read);
+        hasher.process(buffer.data(), read);
+        size += read;
         if(!outputFile.write(buffer.data(), read))
             throw std::runtime_error("Failed to write to disk");
     }
+    outputFile.close();
+    if(!outputFile)
+        throw std::runtime_error("Failed to write to disk");
+    dropFromPageCache(tmpFilepath.string());
+
+    if(bzerror != BZ_STREAM_END || (file.size && size != *file.size) || hasher.toString() != file.hash)
+    {
+        boost::system::error_code ec;
+        bfs::remove(tmpFilepath, ec);
+        return false;
+    }
+    if(!file.mode)
+    {
+        // Keep the permissions (e.g. executable bit) of the file being replaced
+        boost::system::error_code ec;
+        const bfs::file_status targetStatus = bfs::status(targetFilepath, ec);
+        if(!ec && bfs::exists(targetStatus))
+            bfs::permissions(tmpFilepath, targetStatus.permissions(), ec);
+    }
+    replaceFile(tmpFilepath, targetFilepath);
+    return true;
 }
 
-void updateFile(const std::string& httpBase, const std::string& origFilePath, const bool verbose)
+/// Create the path of the file if it does not exist
+void createParentDirectories(const bfs::path& filepath)
+{
+    const bfs::path path = filepath.parent_path();
+    if(path.empty() || bfs::is_directory(path))
+        return;
+    boost::system::error_code ec;
+    bfs::create_directories(path, ec);
+    if(ec)
+    {
+        std::stringstream msg;
+        msg << "Failed to create directories to path " << path << " for " << filepath.filename() << ": "
+            << ec.message() << std::endl;
+        throw std::runtime_error(msg.str());
+    }
+}
+
+/**
+ *  The server keeps the filelists of older builds next to the current one.
+ *  Files which are unchanged in those can be downloaded from there if the current source fails.
+ */
+class FileSources
+{
+    struct Source
+    {
+        std::string httpBase;
+        std::optional<std::vector<FileEntry>> files;
+    };
+    std::string mainBase_;
+    std::vector<Source> fallbacks_;
+
+public:
+    FileSources(std::string mainBase, const std::vector<std::string>& fallbackBases) : mainBase_(std::move(mainBase))
+    {
+        for(const auto& base : fallbackBases)
+            fallbacks_.push_back(Source{base, std::nullopt});
+    }
+
+    /// Get the http base of the idx-th source serving the same content for the file or nothing if there is none
+    std::optional<std::string> get(const FileEntry& file, size_t idx)
+    {
+        if(idx == 0)
+            return mainBase_;
+        for(auto& source : fallbacks_)
+        {
+            if(!source.files)
+            {
+                const auto filelist = DownloadFile(source.httpBase + FILELIST);
+                source.files = filelist ? parseFileList(*filelist) : std::vector<FileEntry>();
+            }
+            const bool hasSameFile =
+              std::any_of(source.files->begin(), source.files->end(), [&file](const FileEntry& entry) {
+                  return entry.path == file.path && entry.hashAlgorithm == file.hashAlgorithm
+                         && entry.hash == file.hash;
+              });
+            if(hasSameFile && --idx == 0)
+                return source.httpBase;
+        }
+        return std::nullopt;
+    }
+};
+
+void updateFile(FileSources& sources, const bfs::path& installDir, const FileEntry& file, const bool verbose)
 {
-    const bfs::path filepath = bfs::path(origFilePath).make_preferred();
+    // Number of times a file is downloaded from the same source if its content does not match the filelist
+    constexpr int maxCorruptDownloadsPerSource = 2;
+
+    const std::string& origFilePath = file.path;
+    const bfs::path filepath = (installDir / origFilePath).make_preferred();
     const bfs::path name = filepath.filename();
     const bfs::path path = filepath.parent_path();
     bfs::path bzfile = filepath;
@@ -493,38 +1016,55 @@ void updateFile(const std::string& httpBase, const std::string& origFilePath, co
         bnw::cout << " to " << path;
     bnw::cout << std::endl;
 
-    // create path of file
-    if(!bfs::is_directory(path))
-    {
-        boost::system::error_code ec;
-        bfs::create_directories(path, ec);
-        if(ec)
-        {
-            std::stringstream msg;
-            msg << "Failed to create directories to path " << path << " for " << name << ": " << ec.message()
-                << std::endl;
-            throw std::runtime_error(msg.str());
-        }
-    }
+    createParentDirectories(filepath);
 
     std::stringstream progress;
     progress << "Downloading " << name;
     while(progress.str().size() < 50)
         progress << " ";
 
-    std::stringstream url;
-    url << httpBase << "/" << bfs::path(origFilePath).parent_path().string() << "/" << EscapeFile(name.string())
-        << ".bz2";
-
-    // download the file
-    if(!DownloadFile(url.str(), bzfile, progress.str()))
+    int corruptDownloads = 0, corruptDownloadsFromSource = 0;
+    for(size_t sourceIdx = 0;;)
     {
-        bnw::cerr << '\r' << progress.str() << " - failed!" << std::endl;
-        throw std::runtime_error("Download of " + bzfile.string() + " failed!");
-    }
+        const auto httpBase = sources.get(file, sourceIdx);
+        if(!httpBase)
+        {
+            bfs::remove(bzfile);
+            if(corruptDownloads > 0)
+                throw std::runtime_error("Downloaded file " + filepath.string() + " does not match the filelist!");
+            throw std::runtime_error("Download of " + bzfile.string() + " failed!");
+        }
+
+        std::stringstream url;
+        url << *httpBase << "/" << bfs::path(origFilePath).parent_path().string() << "/"
+            << EscapeFile(name.string()) << ".bz2";
 
-    // extract the file
-    extractFile(bzfile, filepath);
+        // download the file
+        if(!DownloadFile(url.str(), bzfile, progress.str(), file.size))
+        {
+            bnw::cerr << '\r' << progress.str() << " - failed!" << std::endl;
+            // try the next source serving this file
+            ++sourceIdx;
+            corruptDownloadsFromSource = 0;
+            continue;
+        }
+
+        // extract and verify the file
+        if(extractFile(bzfile, file, filepath))
+            break;
+
+        bnw::cerr << '\r' << progress.str() << " - corrupt!" << std::endl;
+        // The transfer may have been truncated, so retry once before trying the next source serving this file
+        if(++corruptDownloadsFromSource == maxCorruptDownloadsPerSource)
+        {
+            ++sourceIdx;
+            corruptDownloadsFromSource = 0;
+        }
+        const auto delay = getRetryDelay(corruptDownloads++);
+        bnw::cerr << "Retrying download of " << name << " in " << delay.count() << "ms" << std::endl;
+        std::this_thread::sleep_for(delay);
+    }
+    applyFileMode(filepath, file.mode);
 
     bnw::cout << " - ok" << std::endl;
 
@@ -537,6 +1077,289 @@ void updateFile(const std::string& httpBase, const std::string& origFilePath, co
 #endif // !_WIN32
 }
 
+constexpr auto overwrite_existing =
+#if BOOST_VERSION >= 107400
+  bfs::copy_options::overwrite_existing;
+#else
+  bfs::copy_option::overwrite_if_exists;
+#endif
+
+/// Copy the file in chunks respecting the I/O limits and dropping the data from the page cache.
+/// The copied data is passed to the hasher
+void copyFileRestricted(const bfs::path& srcFilepath, const bfs::path& dstFilepath, FileHasher& hasher,
+                        boost::system::error_code& ec)
+{
+    s25util::file_handle src_fh(boost::nowide::fopen(srcFilepath.string().c_str(), "rb"));
+    s25util::file_handle dst_fh(boost::nowide::fopen(dstFilepath.string().c_str(), "wb"));
+    if(!src_fh || !dst_fh)
+    {
+        ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+        return;
+    }
+    avoidPageCache(*src_fh);
+    avoidPageCache(*dst_fh);
+    std::array<char, 64 * 1024> buffer;
+    size_t read;
+    while((read = fread(buffer.data(), 1, buffer.size(), *src_fh)) > 0)
+    {
+        throttleIo(read);
+        hasher.process(buffer.data(), read);
+        if(fwrite(buffer.data(), 1, read, *dst_fh) != read)
+            break;
+    }
+    if(ferror(*src_fh) || ferror(*dst_fh) || fflush(*dst_fh) != 0)
+    {
+        ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+        return;
+    }
+    dropFromPageCache(*src_fh);
+    dropFromPageCache(*dst_fh);
+    // Same as bfs::copy_file
+    bfs::permissions(dstFilepath, bfs::status(srcFilepath, ec).permissions(), ec);
+}
+
+/**
+ *  Copy a local file with the same content to the temporary path of the target.
+ *  Returns false on failure or if the copy does not match the filelist entry, e.g. as the source was changed
+ */
+bool copyToTempFile(const bfs::path& srcFilepath, const FileEntry& file, const bfs::path& filepath)
+{
+    createParentDirectories(filepath);
+    bfs::path tmpFilepath(filepath);
+    tmpFilepath += ".new";
+    {
+        std::lock_guard<std::mutex> lock(consoleMutex);
+        bnw::cout << "Copying " << srcFilepath << " to " << filepath << std::endl;
+    }
+    boost::system::error_code ec;
+    std::optional<std::string> hash;
+    if(isIoRestricted())
+    {
+        FileHasher hasher(file.hashAlgorithm);
+        copyFileRestricted(srcFilepath, tmpFilepath, hasher, ec);
+        if(!ec)
+            hash = hasher.toString();
+    } else
+    {
+        // Boost.Filesystem uses the in kernel copy functions where available, which avoid reading the data
+        bfs::copy_file(srcFilepath, tmpFilepath, overwrite_existing, ec);
+        // Checking the size first avoids reading the copy if the source obviously changed
+        if(!ec && (!file.size || bfs::file_size(tmpFilepath, ec) == *file.size) && !ec)
+            hash = hashsum(tmpFilepath.string(), file.hashAlgorithm);
+    }
+    if(ec)
+    {
+        std::lock_guard<std::mutex> lock(consoleMutex);
+        bnw::cerr << "Failed to copy file " << srcFilepath << " to " << tmpFilepath << ": " << ec.message()
+                  << std::endl;
+        bfs::remove(tmpFilepath, ec);
+        return false;
+    }
+    if(hash != file.hash)
+    {
+        std::lock_guard<std::mutex> lock(consoleMutex);
+        bnw::cerr << "Copy of " << srcFilepath << " does not match the filelist, downloading it instead" << std::endl;
+        bfs::remove(tmpFilepath, ec);
+        return false;
+    }
+    return true;
+}
+
+void commitTempFile(const bfs::path& filepath, const std::optional<unsigned>& mode)
+{
+    bfs::path tmpFilepath(filepath);
+    tmpFilepath += ".new";
+    replaceFile(tmpFilepath, filepath);
+    applyFileMode(filepath, mode);
+}
+
+/// Filelist, links and sources of the nightly or stable version
+struct UpdateChannel
+{
+    std::vector<FileEntry> files;
+    std::vector<std::pair<std::string, std::string>> links;
+    FileSources sources;
+    /// Only requested if the filelist contains a savegame version file
+    std::optional<std::string> savegameVersion;
+};
+
+/// An installation to update and the state of its update
+struct Installation
+{
+    bfs::path dir;
+    bool nightly;
+    /// Files which won't be changed by the update by their content
+    std::map<ContentKey, bfs::path> stableContent;
+    /// Files which will be replaced by the update by their current content
+    std::map<ContentKey, bfs::path> outdatedContent;
+    /// Files which differ from the filelist and are not yet updated
+    std::vector<const FileEntry*> outdatedFiles;
+    bool updated = false;
+    bool canceled = false;
+    std::optional<std::string> error;
+
+    Installation(bfs::path dir, bool nightly) : dir(std::move(dir)), nightly(nightly) {}
+    bfs::path getPath(const FileEntry& file) const { return (dir / file.path).make_preferred(); }
+};
+
+/**
+ *  Look for the content of outdated files in local files which have not been hashed yet:
+ *  Files not in the filelist (e.g. renamed maps) in the folders of the outdated files
+ *  and outdated files whose size differs from their filelist entry.
+ *  Only files with the size of a missing file are hashed, so this requires the sizes from a v2 filelist.
+ */
+void findLocalContent(Installation& installation, const std::vector<FileEntry>& files)
+{
+    std::map<uintmax_t, std::set<HashAlgorithm>> wantedSizes;
+    std::set<bfs::path> folders;
+    for(const FileEntry* file : installation.outdatedFiles)
+    {
+        const ContentKey key = getContentKey(*file);
+        if(!file->size || installation.stableContent.count(key) || installation.outdatedContent.count(key))
+            continue;
+        wantedSizes[*file->size].insert(file->hashAlgorithm);
+        folders.insert(installation.getPath(*file).parent_path());
+    }
+    if(wantedSizes.empty())
+        return;
+
+    std::set<std::string> upToDatePaths, outdatedPaths;
+    for(const auto& file : files)
+        upToDatePaths.insert(installation.getPath(file).generic_string());
+    for(const FileEntry* file : installation.outdatedFiles)
+    {
+        const auto path = installation.getPath(*file).generic_string();
+        upToDatePaths.erase(path);
+        outdatedPaths.insert(path);
+    }
+    // Outdated files already hashed while checking them
+    std::set<std::pair<std::string, HashAlgorithm>> hashedPaths;
+    for(const auto& content : installation.outdatedContent)
+        hashedPaths.emplace(content.second.generic_string(), content.first.first);
+
+    for(const auto& folder : folders)
+    {
+        boost::system::error_code ec;
+        for(bfs::directory_iterator it(folder, ec), end; !ec && it != end; it.increment(ec))
+        {
+            const bfs::path filepath = folder / it->path().filename();
+            const std::string genericPath = filepath.generic_string();
+            // Skip temporary files of the updater as those get overwritten
+            const bfs::path extension = filepath.extension();
+            if(upToDatePaths.count(genericPath) || !bfs::is_regular_file(it->status()) || extension == ".new"
+               || extension == ".bz2")
+                continue;
+            const auto itSize = wantedSizes.find(bfs::file_size(filepath, ec));
+            if(ec || itSize == wantedSizes.end())
+                continue;
+            auto& content =
+              outdatedPaths.count(genericPath) ? installation.outdatedContent : installation.stableContent;
+            for(const HashAlgorithm algorithm : itSize->second)
+            {
+                if(!hashedPaths.count(std::make_pair(genericPath, algorithm)))
+                    content.emplace(ContentKey(algorithm, hashsum(filepath.string(), algorithm)), filepath);
+            }
+        }
+    }
+}
+
+/// Remove the files from the outdated files of the installation
+void setUpdated(Installation& installation, const std::set<const FileEntry*>& updatedFiles)
+{
+    if(updatedFiles.empty())
+        return;
+    auto& outdatedFiles = installation.outdatedFiles;
+    outdatedFiles.erase(std::remove_if(outdatedFiles.begin(), outdatedFiles.end(),
+                                       [&updatedFiles](const FileEntry* file) { return updatedFiles.count(file) > 0; }),
+                        outdatedFiles.end());
+    installation.updated = true;
+}
+
+/// Update outdated files by copying local files with the same content
+void copyFromLocalContent(Installation& installation, const std::map<ContentKey, bfs::path>& content)
+{
+    std::set<const FileEntry*> copiedFiles;
+    for(const FileEntry* file : installation.outdatedFiles)
+    {
+        const auto itSrc = content.find(getContentKey(*file));
+        if(itSrc == content.end())
+            continue;
+        const bfs::path filepath = installation.getPath(*file);
+        if(copyToTempFile(itSrc->second, *file, filepath))
+        {
+            commitTempFile(filepath, file->mode);
+            copiedFiles.insert(file);
+        }
+    }
+    setUpdated(installation, copiedFiles);
+}
+
+/**
+ *  Hash the files of the installation and update all outdated files whose content exists locally.
+ *  Only files whose content is not available locally remain outdated.
+ */
+void updateFromLocalContent(Installation& installation, const std::vector<FileEntry>& files)
+{
+    for(const auto& file : files)
+    {
+        const bfs::path filepath = installation.getPath(file);
+        const auto localHash = hashLocalFile(filepath, file);
+        if(localHash == file.hash)
+        {
+            installation.stableContent.emplace(getContentKey(file), filepath);
+            applyFileMode(filepath, file.mode);
+            continue;
+        }
+        installation.outdatedFiles.push_back(&file);
+        if(localHash)
+            installation.outdatedContent.emplace(ContentKey(file.hashAlgorithm, *localHash), filepath);
+    }
+    if(installation.outdatedFiles.empty())
+        return;
+
+    findLocalContent(installation, files);
+
+    // Content which is only at outdated paths needs to be copied before any of those get replaced
+    std::set<const FileEntry*> copiedFiles;
+    for(const FileEntry* file : installation.outdatedFiles)
+    {
+        const ContentKey key = getContentKey(*file);
+        const auto itSrc = installation.outdatedContent.find(key);
+        if(!installation.stableContent.count(key) && itSrc != installation.outdatedContent.end()
+           && copyToTempFile(itSrc->second, *file, installation.getPath(*file)))
+            copiedFiles.insert(file);
+    }
+    for(const FileEntry* file : copiedFiles)
+    {
+        commitTempFile(installation.getPath(*file), file->mode);
+        installation.stableContent.emplace(getContentKey(*file), installation.getPath(*file));
+    }
+    setUpdated(installation, copiedFiles);
+
+    copyFromLocalContent(installation, installation.stableContent);
+}
+
+/**
+ *  Download the outdated files of the installation and add them to the downloaded content.
+ *  If skipDownloaded is set, files whose content was already downloaded are skipped to be copied instead.
+ */
+void downloadOutdatedFiles(Installation& installation, UpdateChannel& channel,
+                           std::map<ContentKey, bfs::path>& downloadedContent, bool skipDownloaded, bool verbose)
+{
+    std::set<const FileEntry*> downloadedFiles;
+    for(const FileEntry* file : installation.outdatedFiles)
+    {
+        const ContentKey key = getContentKey(*file);
+        if(skipDownloaded && downloadedContent.count(key))
+            continue;
+        updateFile(channel.sources, installation.dir, *file, verbose);
+        downloadedFiles.insert(file);
+        // Further files with the same content are copied from this one
+        downloadedContent.emplace(key, installation.getPath(*file));
+    }
+    setUpdated(installation, downloadedFiles);
+}
+
 /// Copy srcFile to destination or create a symlink at dst pointing to src
 void copyOrSymlink(const bfs::path& srcFileName, const bfs::path& dstFilepath)
 {
@@ -545,12 +1368,6 @@ void copyOrSymlink(const bfs::path& srcFileName, const bfs::path& dstFilepath)
     bfs::path path = dstFilepath.parent_path();
     bfs::path srcFilepath = path / srcFileName;
     boost::system::error_code ec;
-    constexpr auto overwrite_existing =
-#    if BOOST_VERSION >= 107400
-      bfs::copy_options::overwrite_existing;
-#    else
-      bfs::copy_option::overwrite_if_exists;
-#    endif
     bfs::copy_file(srcFilepath, dstFilepath, overwrite_existing, ec);
     if(ec)
         bnw::cerr << "Failed to copy file '" << srcFilepath << "' to '" << dstFilepath << "': " << ec.message()
@@ -582,19 +1399,126 @@ auto getPossibleHttpBases(const bool nightly)
     std::vector<std::string> bases = {archBase + FILEPATH};
     for(int i = 1; i <= 5; i++)
     {
-        url.str(archBase);
-        url << "." << i << FILEPATH;
+        url.str("");
+        url << archBase << "." << i << FILEPATH;
         bases.push_back(url.str());
     }
     return bases;
 }
 
+/// Parse the value of the option at argv[i] as a non-negative number and advance i to it
+long parseNumericArg(int argc, char* argv[], int& i)
+{
+    const std::string option = argv[i];
+    if(++i >= argc)
+        throw std::invalid_argument("Missing value for " + option);
+    char* end;
+    const long value = std::strtol(argv[i], &end, 10);
+    if(*end != '\0' || end == argv[i] || value < 0)
+        throw std::invalid_argument("Invalid value for " + option + ": " + argv[i]);
+    return value;
+}
+
+/// Download filelist and linklist of the channel
+UpdateChannel fetchChannel(const bool nightly, const bool verbose)
+{
+    if(verbose)
+        bnw::cout << "Requesting current " << (nightly ? "nightly" : "stable") << " version information from server..."
+                  << std::endl;
+    std::string httpbase, filelist;
+    const auto possibleBases = getPossibleHttpBases(nightly);
+    size_t baseIdx = 0;
+    for(; baseIdx < possibleBases.size(); baseIdx++)
+    {
+        const std::string url = possibleBases[baseIdx] + FILELIST;
+        if(verbose)
+            bnw::cout << "Trying to download update filelist from '" << url << '"' << std::endl;
+        auto filelistOpt = DownloadFile(url);
+        if(!filelistOpt)
+            bnw::cout << "Warning: Was not able to get update filelist " << baseIdx << ", trying older one"
+                      << std::endl;
+        else
+        {
+            filelist = *filelistOpt;
+            httpbase = possibleBases[baseIdx];
+            break;
+        }
+    }
+    if(filelist.empty())
+        throw std::runtime_error("Could not get any update filelist");
+
+    // httpbase now includes targetpath and filepath
+
+    // download linklist
+    const auto linklist = DownloadFile(httpbase + LINKLIST);
+    if(!linklist)
+        bnw::cout << "Warning: Was not able to get linkfile, ignoring" << std::endl;
+
+    if(verbose)
+        bnw::cout << "Parsing update list..." << std::endl;
+
+    UpdateChannel channel{
+      parseFileList(filelist), linklist ? parseLinkList(*linklist) : std::vector<std::pair<std::string, std::string>>(),
+      FileSources(httpbase, std::vector<std::string>(possibleBases.begin() + baseIdx + 1, possibleBases.end())),
+      std::nullopt};
+    const bool hasSavegameVersion = std::any_of(channel.files.begin(), channel.files.end(), [](const auto& it) {
+        return it.path.find(SAVEGAMEVERSION) != std::string::npos;
+    });
+    if(hasSavegameVersion)
+        channel.savegameVersion = DownloadFile(httpbase + SAVEGAMEVERSION);
+    return channel;
+}
+
+/// Run the function for all installations without error using up to numThreads threads.
+/// Exceptions are stored as the error of the installation.
+template<typename T_Func>
+void forEachInstallation(std::vector<Installation>& installations, const unsigned numThreads, T_Func&& func)
+{
+    std::atomic<size_t> nextIdx(0);
+    const auto worker = [&]() {
+        for(size_t idx; (idx = nextIdx++) < installations.size();)
+        {
+            Installation& installation = installations[idx];
+            if(installation.error || installation.canceled)
+                continue;
+            try
+            {
+                func(installation);
+            } catch(const std::exception& e)
+            {
+                installation.error = e.what();
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for(size_t i = 1; i < std::min<size_t>(numThreads, installations.size()); i++)
+        threads.emplace_back(worker);
+    worker();
+    for(auto& thread : threads)
+        thread.join();
+}
+
+/// Get a unique representation of the (possibly not yet existing) directory to detect duplicates
+bfs::path normalizeDirPath(const bfs::path& dir)
+{
+    bfs::path result = bfs::weakly_canonical(bfs::absolute(dir)).lexically_normal();
+    // "foo/" and "foo/." end in "." which would not compare equal to "foo"
+    while(result.filename() == "." && result.has_parent_path())
+        result = result.parent_path();
+    return result;
+}
+
 void executeUpdate(int argc, char* argv[])
 {
     using namespace std::string_literals;
-    bool updated = false;
     bool verbose = false;
-    bool nightly = true;
+    bool background = false;
+    // Disk I/O limit in bytes/s
+    std::optional<uint64_t> ioLimit;
+    constexpr uint64_t defaultBackgroundIoLimit = 16 * 1024 * 1024;
+    // Threads used for hashing and writing files of different installations
+    unsigned numThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::optional<unsigned> numThreadsArg;
     bfs::path workPath = bfs::absolute(argv[0]).parent_path().lexically_normal();
 
     // If the installation is the default one, update current installation
@@ -613,6 +1537,10 @@ void executeUpdate(int argc, char* argv[])
         workPath = tmpPath;
 #endif
 
+    // --stable/--nightly apply to the following directories.
+    // Directories before the first of those use its channel, so "--dir X --stable" works as well
+    std::vector<std::pair<bfs::path, std::optional<bool>>> dirs;
+    std::optional<bool> firstNightly, nightly;
     if(argc > 1)
     {
         for(int i = 1; i < argc; ++i)
@@ -620,102 +1548,194 @@ void executeUpdate(int argc, char* argv[])
             if(strcmp(argv[i], "--verbose") == 0 || strcmp(argv[i], "-v") == 0)
                 verbose = true;
             if(strcmp(argv[i], "--dir") == 0 || strcmp(argv[i], "-d") == 0)
-                workPath = argv[++i];
+            {
+                if(i + 1 >= argc)
+                    throw std::invalid_argument("Missing value for "s + argv[i]);
+                dirs.emplace_back(normalizeDirPath(argv[++i]), nightly);
+            }
             if(strcmp(argv[i], "--stable") == 0 || strcmp(argv[i], "-s") == 0)
                 nightly = false;
+            if(strcmp(argv[i], "--nightly") == 0 || strcmp(argv[i], "-n") == 0)
+                nightly = true;
+            if(!firstNightly)
+                firstNightly = nightly;
+            if(strcmp(argv[i], "--retries") == 0)
+                downloadOptions.retries = static_cast<int>(parseNumericArg(argc, argv, i));
+            if(strcmp(argv[i], "--connect-timeout") == 0)
+                downloadOptions.connectTimeout = parseNumericArg(argc, argv, i);
+            if(strcmp(argv[i], "--low-speed-limit") == 0)
+                downloadOptions.lowSpeedLimit = parseNumericArg(argc, argv, i);
+            if(strcmp(argv[i], "--low-speed-time") == 0)
+                downloadOptions.lowSpeedTime = parseNumericArg(argc, argv, i);
+            if(strcmp(argv[i], "--download-limit") == 0)
+                downloadOptions.maxDownloadRate = parseNumericArg(argc, argv, i) * 1024;
+            if(strcmp(argv[i], "--io-limit") == 0)
+                ioLimit = parseNumericArg(argc, argv, i) * 1024;
+            if(strcmp(argv[i], "--background") == 0)
+                background = true;
+            if(strcmp(argv[i], "--segments") == 0)
+                downloadOptions.numSegments = static_cast<int>(parseNumericArg(argc, argv, i));
+            if(strcmp(argv[i], "--jobs") == 0 || strcmp(argv[i], "-j") == 0)
+                numThreadsArg = std::max(1u, static_cast<unsigned>(parseNumericArg(argc, argv, i)));
         }
     }
 
-    if(verbose)
-        bnw::cout << "Using directory " << workPath << std::endl;
-    boost::system::error_code error;
-    bfs::current_path(workPath, error);
-    if(error)
-        bnw::cerr << "Warning: Failed to set working directory: " << error << std::endl;
+    if(background)
+    {
+        // Avoid disturbing other processes like game servers on the same machine
+        if(!lowerProcessPriority())
+            bnw::cerr << "Warning: Failed to lower process priority" << std::endl;
+        setDropFromPageCache(true);
+        if(!ioLimit)
+            ioLimit = defaultBackgroundIoLimit;
+        numThreads = 1;
+    }
+    if(ioLimit)
+        setIoRateLimit(*ioLimit);
+    if(numThreadsArg)
+        numThreads = *numThreadsArg;
+
+    if(dirs.empty())
+        dirs.emplace_back(workPath, std::nullopt);
+    std::vector<Installation> installations;
+    for(const auto& dir : dirs)
+    {
+        const bool dirNightly = dir.second.value_or(firstNightly.value_or(true));
+        const auto itExisting = std::find_if(installations.begin(), installations.end(),
+                                             [&dir](const Installation& cur) { return cur.dir == dir.first; });
+        if(itExisting == installations.end())
+            installations.emplace_back(dir.first, dirNightly);
+        else if(itExisting->nightly != dirNightly)
+            throw std::invalid_argument("Directory " + dir.first.string() + " is given for stable and nightly");
+        // Else the same directory was passed multiple times and is only updated once
+    }
 
-    if(!isCurrentDirWritable())
+    for(Installation& installation : installations)
     {
-        if(runAsAdmin(argc, argv))
+        if(verbose)
+            bnw::cout << "Using directory " << installation.dir << std::endl;
+        boost::system::error_code error;
+        bfs::create_directories(installation.dir, error);
+        if(error)
+            installation.error = "Failed to create directory: " + error.message();
+        else if(!isDirWritable(installation.dir))
         {
-            bnw::cout << "Update should have been run successfully" << std::endl;
-            return;
-        } else
-            throw std::runtime_error("Update failed. Current dir is not writeable");
+            if(installations.size() == 1)
+            {
+                if(runAsAdmin(argc, argv))
+                {
+                    bnw::cout << "Update should have been run successfully" << std::endl;
+                    return;
+                } else
+                    throw std::runtime_error("Update failed. Current dir is not writeable");
+            }
+            installation.error = "Directory is not writeable";
+        }
     }
 
     // initialize curl
     curl_global_init(CURL_GLOBAL_ALL);
     atexit(curl_global_cleanup);
 
-    // download filelist
-    if(verbose)
-        bnw::cout << "Requesting current version information from server..." << std::endl;
-    std::string httpbase, filelist;
-    const auto possibleBases = getPossibleHttpBases(nightly);
-    for(size_t i = 0; i < possibleBases.size(); i++)
+    // Filelists etc. are only fetched once for all installations using the same channel
+    std::map<bool, UpdateChannel> channels;
+    for(Installation& installation : installations)
     {
-        const std::string url = possibleBases[i] + FILELIST;
-        if(verbose)
-            bnw::cout << "Trying to download update filelist from '" << url << '"' << std::endl;
-        auto filelistOpt = DownloadFile(url);
-        if(!filelistOpt)
-            bnw::cout << "Warning: Was not able to get update filelist " << i << ", trying older one" << std::endl;
-        else
+        if(installation.error || channels.count(installation.nightly))
+            continue;
+        try
         {
-            filelist = *filelistOpt;
-            httpbase = possibleBases[i];
-            break;
+            channels.emplace(installation.nightly, fetchChannel(installation.nightly, verbose));
+        } catch(const std::exception& e)
+        {
+            for(Installation& curInstallation : installations)
+            {
+                if(curInstallation.nightly == installation.nightly)
+                    curInstallation.error = e.what();
+            }
         }
     }
-    if(filelist.empty())
-        throw std::runtime_error("Could not get any update filelist");
-
-    // httpbase now includes targetpath and filepath
 
-    // download linklist
-    const auto linklist = DownloadFile(httpbase + LINKLIST);
-    if(!linklist)
-        bnw::cout << "Warning: Was not able to get linkfile, ignoring" << std::endl;
-
-    if(verbose)
-        bnw::cout << "Parsing update list..." << std::endl;
-
-    const auto files = parseFileList(filelist);
-    const auto itSavegameversion = std::find_if(
-      files.begin(), files.end(), [](const auto& it) { return it.second.find(SAVEGAMEVERSION) != std::string::npos; });
-
-    if(itSavegameversion != files.end() && bfs::exists(itSavegameversion->second))
+    for(Installation& installation : installations)
     {
-        if(!ValidateSavegameVersion(httpbase, itSavegameversion->second))
-            return;
+        if(installation.error)
+            continue;
+        const UpdateChannel& channel = channels.at(installation.nightly);
+        const auto itSavegameversion =
+          std::find_if(channel.files.begin(), channel.files.end(),
+                       [](const auto& it) { return it.path.find(SAVEGAMEVERSION) != std::string::npos; });
+        if(itSavegameversion != channel.files.end() && bfs::exists(installation.getPath(*itSavegameversion)))
+        {
+            if(installations.size() > 1)
+                bnw::cout << "Checking savegame version of " << installation.dir << std::endl;
+            if(!ValidateSavegameVersion(channel.savegameVersion, installation.getPath(*itSavegameversion)))
+                installation.canceled = true;
+        }
     }
 
-    const auto links = parseLinkList(*linklist);
-
-    // check md5 of files and download them
-    for(const auto& file : files)
+    // Hash the files and use local files first as that does not need the network
+    forEachInstallation(installations, numThreads, [&channels](Installation& installation) {
+        updateFromLocalContent(installation, channels.at(installation.nightly).files);
+    });
+    // Download each content only once...
+    std::map<ContentKey, bfs::path> downloadedContent;
+    // ... or not at all if it is already up to date in any installation
+    for(const Installation& installation : installations)
     {
-        const std::string hash = file.first;
-        const std::string filePath = file.second;
-
-        if(hash == md5sum(filePath))
-            continue;
-
-        updateFile(httpbase, filePath, verbose);
-        updated = true;
+        if(!installation.error && !installation.canceled)
+            downloadedContent.insert(installation.stableContent.begin(), installation.stableContent.end());
     }
+    forEachInstallation(installations, 1, [&](Installation& installation) {
+        downloadOutdatedFiles(installation, channels.at(installation.nightly), downloadedContent, true, verbose);
+    });
+    // ... and copy it to the other installations
+    forEachInstallation(installations, numThreads, [&downloadedContent](Installation& installation) {
+        copyFromLocalContent(installation, downloadedContent);
+    });
+    // Download what could not be copied
+    forEachInstallation(installations, 1, [&](Installation& installation) {
+        downloadOutdatedFiles(installation, channels.at(installation.nightly), downloadedContent, false, verbose);
+    });
 
     if(verbose)
         bnw::cout << "Updating folder structure..." << std::endl;
 
-    for(const auto& link : links)
+    forEachInstallation(installations, 1, [&channels](Installation& installation) {
+        for(const auto& link : channels.at(installation.nightly).links)
+        {
+            // Note: Symlink = first pointing to second (second exists)
+            copyOrSymlink(link.second, installation.dir / link.first);
+        }
+    });
+
+    if(installations.size() == 1)
     {
-        // Note: Symlink = first pointing to second (second exists)
-        copyOrSymlink(link.second, link.first);
+        const Installation& installation = installations.front();
+        if(installation.error)
+            throw std::runtime_error(*installation.error);
+        if(installation.updated)
+            bnw::cout << "Update finished!" << std::endl;
+        return;
     }
 
-    if(updated)
-        bnw::cout << "Update finished!" << std::endl;
+    size_t numFailed = 0;
+    for(const Installation& installation : installations)
+    {
+        bnw::cout << installation.dir << " (" << (installation.nightly ? "nightly" : "stable") << "): ";
+        if(installation.error)
+        {
+            bnw::cout << "Update failed: " << *installation.error << std::endl;
+            numFailed++;
+        } else if(installation.canceled)
+            bnw::cout << "Update canceled" << std::endl;
+        else if(installation.updated)
+            bnw::cout << "Update finished!" << std::endl;
+        else
+            bnw::cout << "Up to date" << std::endl;
+    }
+    if(numFailed > 0)
+        throw std::runtime_error(std::to_string(numFailed) + " of " + std::to_string(installations.size())
+                                 + " installations failed");
 }
 } // namespace
 
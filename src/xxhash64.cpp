@@ -0,0 +1,133 @@
+// Copyright (C) 2005 - 2026 Settlers Freaks <sf-team at siedler25.org>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include "xxhash64.h"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+constexpr uint64_t rotl(uint64_t value, unsigned bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+/// Read little endian values independent of host byte order and alignment
+uint64_t read64(const uint8_t* p)
+{
+    uint64_t result = 0;
+    for(int i = 7; i >= 0; --i)
+        result = (result << 8) | p[i];
+    return result;
+}
+
+uint32_t read32(const uint8_t* p)
+{
+    return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 | static_cast<uint32_t>(p[2]) << 16
+           | static_cast<uint32_t>(p[3]) << 24;
+}
+
+uint64_t round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+uint64_t mergeRound(uint64_t acc, uint64_t value)
+{
+    acc ^= round(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+void processStripe(std::array<uint64_t, 4>& acc, const uint8_t* p)
+{
+    acc[0] = round(acc[0], read64(p));
+    acc[1] = round(acc[1], read64(p + 8));
+    acc[2] = round(acc[2], read64(p + 16));
+    acc[3] = round(acc[3], read64(p + 24));
+}
+} // namespace
+
+Xxh64::Xxh64(uint64_t seed)
+    : acc_{seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1}, buffer_(), seed_(seed)
+{}
+
+void Xxh64::process(const void* data, size_t len)
+{
+    const auto* p = static_cast<const uint8_t*>(data);
+    const uint8_t* const end = p + len;
+    totalLen_ += len;
+
+    // Fill up a partial stripe from the last call first
+    if(bufferSize_ > 0)
+    {
+        const size_t toCopy = std::min(buffer_.size() - bufferSize_, len);
+        std::copy(p, p + toCopy, buffer_.begin() + bufferSize_);
+        bufferSize_ += toCopy;
+        p += toCopy;
+        if(bufferSize_ < buffer_.size())
+            return;
+        processStripe(acc_, buffer_.data());
+        bufferSize_ = 0;
+    }
+
+    for(; end - p >= static_cast<ptrdiff_t>(buffer_.size()); p += buffer_.size())
+        processStripe(acc_, p);
+
+    std::copy(p, end, buffer_.begin());
+    bufferSize_ = end - p;
+}
+
+uint64_t Xxh64::digest() const
+{
+    uint64_t h;
+    if(totalLen_ >= buffer_.size())
+    {
+        h = rotl(acc_[0], 1) + rotl(acc_[1], 7) + rotl(acc_[2], 12) + rotl(acc_[3], 18);
+        for(const uint64_t v : acc_)
+            h = mergeRound(h, v);
+    } else
+        h = seed_ + PRIME5;
+    h += totalLen_;
+
+    const uint8_t* p = buffer_.data();
+    const uint8_t* const end = p + bufferSize_;
+    for(; end - p >= 8; p += 8)
+    {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if(end - p >= 4)
+    {
+        h ^= read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for(; p < end; ++p)
+    {
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+std::string Xxh64::toString() const
+{
+    std::stringstream result;
+    result << std::hex << std::setfill('0') << std::setw(16) << digest();
+    return result.str();
+}
@@ -0,0 +1,29 @@
+// Copyright (C) 2005 - 2026 Settlers Freaks <sf-team at siedler25.org>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/// Streaming implementation of the XXH64 non-cryptographic hash (xxHash by Yann Collet)
+/// Produces the same canonical (big endian hex) digest as `xxhsum -H1`
+class Xxh64
+{
+public:
+    explicit Xxh64(uint64_t seed = 0);
+
+    void process(const void* data, size_t len);
+    uint64_t digest() const;
+    std::string toString() const;
+
+private:
+    std::array<uint64_t, 4> acc_;
+    std::array<uint8_t, 32> buffer_;
+    size_t bufferSize_ = 0;
+    uint64_t totalLen_ = 0;
+    uint64_t seed_;
+};